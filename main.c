@@ -25,9 +25,54 @@ struct object {
     char *strtab;
     int symtab_count, trelocs_count, drelocs_count;
     u32 text_slide, data_slide, bss_slide;
+    u32 size, hash;
+    int owns_filename;
+    /* Where to read the object back from in low memory mode, and its */
+    /* sections and relocations while it is being streamed out */
+    char *source;
+    long source_offset;
+    char *sections;
 };
 
-#define MAX_OBJECTS 256
+/* Archive member held back inside a --start-group ... --end-group */
+struct member {
+    char *filename;
+    void *raw;
+    u32 size;
+    int owns_filename, loaded;
+    char *source;
+    long source_offset;
+    struct cached_object *cached;
+};
+
+/* Group symbol index entry, member is -1 for already linked definitions */
+struct symdef {
+    char *name;
+    u32 hash;
+    int member;
+    struct symdef *next;
+};
+
+#define SYMDEF_BUCKETS 4096
+
+/* Batch mode reads and parses each archive once per process. The members */
+/* are kept with their content hash and the definitions they provide, and */
+/* links share their sections and string tables, only the symbol table */
+/* and relocations, which linking modifies, are copied per link */
+struct cached_object {
+    char *filename;
+    void *raw;
+    u32 size, hash;
+    struct symdef *defs;
+    int defs_count;
+    struct cached_object *next;
+};
+
+struct cached_file {
+    char *filename;
+    struct cached_object *objects, *last;
+    struct cached_file *next;
+};
 
 struct exec {
     u32 a_midmag;
@@ -55,6 +100,11 @@ struct relocation_info {
 
 #define N_GETMAGIC(exec) ((exec).a_midmag & 0xffff)
 
+/* r_type of a pc relative relocation against a symbol of the same object: */
+/* pcrel set, extern, baserel, jmptable, relative and copy clear */
+#define R_LOCAL_PCREL_MASK 0xf9000000UL
+#define R_LOCAL_PCREL 0x01000000UL
+
 #define OMAGIC 0407
 #define NMAGIC 0410
 #define ZMAGIC 0413
@@ -80,12 +130,23 @@ struct ar_header {
 
 /* Globals */
 
-static int v = 0, nostdlib = 0, strip_all = 0, impure = 0;
-static void *output = NULL, *text = NULL, *data = NULL;
+static int v = 0, nostdlib = 0, strip_all = 0, impure = 0, low_memory = 0;
+static void *output = NULL;
+static FILE *output_stream = NULL;
+static u32 text_off = 0, data_off = 0;
 static u32 text_size = 0, data_size = 0, bss_size = 0;
 static u32 text_ptr = 0, data_ptr = 0, bss_ptr = 0;
-static struct object objects[MAX_OBJECTS];
-static int object_count = 0;
+static struct object *objects = NULL;
+static int object_count = 0, objects_max = 0;
+static struct member *members = NULL;
+static int member_count = 0, members_max = 0, in_group = 0;
+static int batch = 0;
+static struct cached_file *cache = NULL, *recording = NULL;
+static char *source = NULL, *source_file_name = NULL;
+static long source_offset = 0;
+static FILE *source_file = NULL;
+static char zero_page[PAGE_SIZE];
+static u32 local_pcrel_relocs = 0, local_relocs = 0, external_relocs = 0;
 static char *program_name = NULL;
 
 struct gr {
@@ -97,6 +158,80 @@ struct gr {
 static struct gr tgr = { 0, 64, NULL };
 static struct gr dgr = { 0, 64, NULL };
 
+static void close_source(void) {
+    if (source_file != NULL) {
+        fclose(source_file);
+        source_file = NULL;
+    }
+    if (source_file_name != NULL) {
+        free(source_file_name);
+        source_file_name = NULL;
+    }
+}
+
+/* Read part of an object back from the file it was found in, the last */
+/* file is kept open since objects mostly come in runs from one archive */
+static int read_source(char *filename, long offset, void *buf, u32 size) {
+    int old_errno;
+
+    if (size == 0) {
+        return 0;
+    }
+
+    if (source_file != NULL && strcmp(source_file_name, filename) != 0) {
+        close_source();
+    }
+
+    if (source_file == NULL) {
+        source_file_name = malloc(strlen(filename) + 1);
+        if (source_file_name == NULL) {
+            goto out_perror;
+        }
+        strcpy(source_file_name, filename);
+
+        source_file = fopen(filename, "rb");
+        if (source_file == NULL) {
+            old_errno = errno;
+            close_source();
+            errno = old_errno;
+            goto out_perror;
+        }
+    }
+
+    if (fseek(source_file, offset, SEEK_SET) != 0) {
+        goto out_perror;
+    }
+
+    if (fread(buf, size, 1, source_file) != 1) {
+        goto out_perror;
+    }
+
+    return 0;
+
+out_perror:
+    old_errno = errno;
+    fprintf(stderr, "%s", program_name);
+    errno = old_errno;
+    perror(": error");
+    return 1;
+}
+
+static void slide_relocations(struct object *object) {
+    int i;
+
+    for (i = 0; i < object->trelocs_count; i++) {
+        struct relocation_info *rel = &object->trelocs[i];
+
+        rel->r_address += object->text_slide;
+    }
+
+    for (i = 0; i < object->drelocs_count; i++) {
+        struct relocation_info *rel = &object->drelocs[i];
+
+        rel->r_address += text_size + object->data_slide;
+    }
+}
+
 static void apply_slides(struct object *object) {
     int i;
 
@@ -137,16 +272,8 @@ static void apply_slides(struct object *object) {
         }
     }
 
-    for (i = 0; i < object->trelocs_count; i++) {
-        struct relocation_info *rel = &object->trelocs[i];
-
-        rel->r_address += object->text_slide;
-    }
-
-    for (i = 0; i < object->drelocs_count; i++) {
-        struct relocation_info *rel = &object->drelocs[i];
-
-        rel->r_address += text_size + object->data_slide;
+    if (object->trelocs != NULL) {
+        slide_relocations(object);
     }
 }
 
@@ -157,27 +284,32 @@ static void paste(struct object *object) {
 
     header = object->header;
 
+    /* In low memory mode this only lays the object out, see stream() */
     object->text_slide = text_ptr;
-    obj_text = (char *)object->raw + sizeof(struct exec);
+    obj_text = (char *)header + sizeof(struct exec);
     if (impure) {
         obj_text_size = header->a_text;
     } else {
         obj_text_size = ALIGN_UP(header->a_text, PAGE_SIZE);
     }
 
-    memcpy((char *)text + text_ptr, obj_text, header->a_text);
+    if (output != NULL) {
+        memcpy((char *)output + text_off + text_ptr, obj_text, header->a_text);
+    }
 
     text_ptr += obj_text_size;
 
     object->data_slide = data_ptr;
-    obj_data = (char *)object->raw + sizeof(struct exec) + header->a_text;
+    obj_data = (char *)header + sizeof(struct exec) + header->a_text;
     if (impure) {
         obj_data_size = header->a_data;
     } else {
         obj_data_size = ALIGN_UP(header->a_data, PAGE_SIZE);
     }
 
-    memcpy((char *)data + data_ptr, obj_data, header->a_data);
+    if (output != NULL) {
+        memcpy((char *)output + data_off + data_ptr, obj_data, header->a_data);
+    }
 
     data_ptr += obj_data_size;
 
@@ -200,8 +332,100 @@ static void strip_arg(int *argc, char *argv[], int index) {
     *argc -= 1;
 }
 
-static int initialise_gen(void *object, char *filename, int quiet) {
-    int err = 0;
+/* FNV-1a */
+static u32 content_hash(void *object, u32 size) {
+    u8 *p = object;
+    u32 hash = 2166136261u;
+
+    while (size-- > 0) {
+        hash ^= *p++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/* Size of an object without the padding of the file or archive it is in */
+static u32 content_size(void *object, u32 size) {
+    struct exec *header = object;
+    u32 strtab_off, strtab_size;
+
+    strtab_off = sizeof(struct exec) + header->a_text + header->a_data
+               + header->a_trsize + header->a_drsize + header->a_syms;
+
+    if (strtab_off + sizeof(u32) > size) {
+        return size;
+    }
+
+    memcpy(&strtab_size, (char *)object + strtab_off, sizeof(u32));
+    if (strtab_size > size - strtab_off) {
+        return size;
+    }
+
+    return strtab_off + strtab_size;
+}
+
+/* Low memory mode only keeps the header, symbol and string tables */
+static void *compact_object(void *object, u32 size) {
+    struct exec *header = object;
+    void *compacted;
+    u32 symtab_off, strtab_size;
+
+    symtab_off = sizeof(struct exec) + header->a_text + header->a_data
+               + header->a_trsize + header->a_drsize;
+    strtab_size = size > symtab_off + header->a_syms ? size - symtab_off - header->a_syms : 0;
+
+    compacted = malloc(sizeof(struct exec) + header->a_syms + strtab_size);
+    if (compacted == NULL) {
+        int old_errno = errno;
+        fprintf(stderr, "%s", program_name);
+        errno = old_errno;
+        perror(": error");
+        return NULL;
+    }
+
+    memcpy(compacted, header, sizeof(struct exec));
+    memcpy((char *)compacted + sizeof(struct exec), (char *)object + symtab_off,
+           header->a_syms + strtab_size);
+
+    return compacted;
+}
+
+/* Returns 1 if the registered object holds exactly these bytes, -1 on error */
+static int same_content(struct object *registered, void *object, u32 size) {
+    int same, old_errno;
+    void *raw;
+
+    if (!low_memory) {
+        return memcmp(registered->header, object, size) == 0;
+    }
+
+    raw = malloc(size);
+    if (raw == NULL) {
+        old_errno = errno;
+        fprintf(stderr, "%s", program_name);
+        errno = old_errno;
+        perror(": error");
+        return -1;
+    }
+
+    if (read_source(registered->source, registered->source_offset, raw, size) != 0) {
+        free(raw);
+        return -1;
+    }
+
+    same = memcmp(raw, object, size) == 0;
+    free(raw);
+
+    return same;
+}
+
+/* On success the object is owned by objects[], or freed if it is a */
+/* byte-identical copy of one already there. A shared object belongs to */
+/* the batch cache, objects[] only gets a copy of its symbol table and */
+/* relocations then. */
+static int register_object(void *object, u32 size, u32 hash, char *filename, int owns_filename, int shared) {
+    int err = 0, i, same;
     struct exec *header;
     struct nlist *symtab;
     struct relocation_info *trelocs, *drelocs;
@@ -209,14 +433,33 @@ static int initialise_gen(void *object, char *filename, int quiet) {
     int symtab_count, trelocs_count, drelocs_count;
     u32 symtab_off, strtab_off, trelocs_off, drelocs_off;
     struct object *new_object;
+    void *private = NULL;
 
     header = object;
 
-    if (N_GETMAGIC(*header) != OMAGIC) {
-        if (!quiet) {
-            fprintf(stderr, "%s: error: %s is not a valid a.out object file.\n", program_name, filename);
+    for (i = 0; i < object_count; i++) {
+        if (objects[i].hash != hash || objects[i].size != size) {
+            continue;
+        }
+
+        same = same_content(&objects[i], object, size);
+        if (same == -1) {
+            err = 1;
+            goto out;
+        }
+        if (!same) {
+            continue;
+        }
+
+        fprintf(stderr, "%s: warning: %s is identical to %s, linking it once\n",
+                program_name, filename, objects[i].filename);
+
+        if (!shared) {
+            free(object);
+        }
+        if (owns_filename) {
+            free(filename);
         }
-        err = 1;
         goto out;
     }
 
@@ -244,16 +487,50 @@ static int initialise_gen(void *object, char *filename, int quiet) {
     drelocs = (void *)((char *)object + drelocs_off);
     strtab = (char *)object + strtab_off;
 
-    if (object_count == MAX_OBJECTS) {
-        fprintf(stderr, "%s: error: Too many objects\n", program_name);
-        err = 1;
-        goto out;
+    if (shared) {
+        /* Relocations and symbol table are contiguous, copy them in one go */
+        private = malloc(strtab_off - trelocs_off + 1);
+        if (private == NULL) {
+            int old_errno = errno;
+            fprintf(stderr, "%s", program_name);
+            errno = old_errno;
+            perror(": error");
+            err = 1;
+            goto out;
+        }
+        memcpy(private, trelocs, strtab_off - trelocs_off);
+
+        trelocs = private;
+        drelocs = (void *)((char *)private + (drelocs_off - trelocs_off));
+        symtab = (void *)((char *)private + (symtab_off - trelocs_off));
+    }
+
+    if (object_count >= objects_max) {
+        void *tmp;
+        int new_max = objects_max == 0 ? 64 : objects_max * 2;
+        tmp = realloc(objects, new_max * sizeof(struct object));
+        if (tmp == NULL) {
+            int old_errno = errno;
+            fprintf(stderr, "%s", program_name);
+            errno = old_errno;
+            perror(": error");
+            if (private != NULL) {
+                free(private);
+            }
+            err = 1;
+            goto out;
+        }
+        objects = tmp;
+        objects_max = new_max;
     }
     new_object = &objects[object_count];
     object_count++;
 
     new_object->filename = filename;
-    new_object->raw = object;
+    new_object->size = size;
+    new_object->hash = hash;
+    new_object->owns_filename = owns_filename;
+    new_object->raw = shared ? private : object;
     new_object->header = header;
     new_object->trelocs = trelocs;
     new_object->drelocs = drelocs;
@@ -262,134 +539,679 @@ static int initialise_gen(void *object, char *filename, int quiet) {
     new_object->trelocs_count = trelocs_count;
     new_object->drelocs_count = drelocs_count;
     new_object->symtab_count = symtab_count;
+    new_object->source = source;
+    new_object->source_offset = source_offset;
+    new_object->sections = NULL;
+
+    if (low_memory) {
+        /* Sections and relocations are read back from the source when needed */
+        new_object->raw = compact_object(object, size);
+        if (new_object->raw == NULL) {
+            object_count--;
+            err = 1;
+            goto out;
+        }
+        free(object);
+
+        new_object->header = new_object->raw;
+        new_object->symtab = (void *)((char *)new_object->raw + sizeof(struct exec));
+        new_object->strtab = (char *)new_object->symtab + new_object->header->a_syms;
+        new_object->trelocs = NULL;
+        new_object->drelocs = NULL;
+    }
 
 out:
     return err;
 }
 
-static u32 conv_dec(char *str, int max) {
-    u32 value = 0;
-    while (*str != ' ' && max-- > 0) {
-        value *= 10;
-        value += *str++ - '0';
+static int initialise_gen(void *object, u32 size, char *filename, int owns_filename, int quiet) {
+    if (N_GETMAGIC(*(struct exec *)object) != OMAGIC) {
+        if (!quiet) {
+            fprintf(stderr, "%s: error: %s is not a valid a.out object file.\n", program_name, filename);
+        }
+        return 1;
     }
-    return value;
+
+    size = content_size(object, size);
+
+    return register_object(object, size, content_hash(object, size), filename, owns_filename, 0);
 }
 
-static int initialise_archive(FILE *ar_file) {
-    int err = 0, old_errno;
-    void *object = NULL;
+static struct member *new_member(void) {
+    struct member *member;
 
-    if (fseek(ar_file, 8, SEEK_SET) != 0) {
-        goto out_perror;
+    if (member_count >= members_max) {
+        void *tmp;
+        int new_max = members_max == 0 ? 64 : members_max * 2;
+        tmp = realloc(members, new_max * sizeof(struct member));
+        if (tmp == NULL) {
+            int old_errno = errno;
+            fprintf(stderr, "%s", program_name);
+            errno = old_errno;
+            perror(": error");
+            return NULL;
+        }
+        members = tmp;
+        members_max = new_max;
     }
 
-    for (;;) {
-        struct ar_header header;
-        u32 size, size_aligned;
+    member = &members[member_count];
+    member_count++;
 
-        if (fread(&header, sizeof(struct ar_header), 1, ar_file) != 1) {
-            if (feof(ar_file)) {
-                break;
-            }
-            goto out_perror;
-        }
+    member->source = source;
+    member->source_offset = source_offset;
+    member->loaded = 0;
+    member->cached = NULL;
 
-        size = conv_dec(header.size, 10);
-        size_aligned = size % 2 ? size + 1 : size;
+    return member;
+}
 
-        if (memcmp(header.name, "__.SYMDEF", 9) == 0) {
-            /* size should probably be size_aligned but binutils 2.14a seems */
-            /* to maybe be bugged and not pad __.SYMDEF? */
-            fseek(ar_file, size, SEEK_CUR);
-            continue;
-        }
+static int initialise_member(void *object, u32 size, char *filename, int owns_filename, int quiet) {
+    struct member *member;
 
-        if (v) {
-            fprintf(stderr, "Archiver: Processing file %.16s (size %u)\n", header.name, size);
-        }
+    if (!in_group) {
+        return initialise_gen(object, size, filename, owns_filename, quiet);
+    }
 
-        object = malloc(size_aligned);
-        if (object == NULL) {
-            goto out_perror;
+    if (N_GETMAGIC(*(struct exec *)object) != OMAGIC) {
+        if (!quiet) {
+            fprintf(stderr, "%s: error: %s is not a valid a.out object file.\n", program_name, filename);
         }
+        return 1;
+    }
 
-        if (fread(object, size_aligned, 1, ar_file) != 1) {
-            goto out_perror;
-        }
+    member = new_member();
+    if (member == NULL) {
+        return 1;
+    }
 
-        if (initialise_gen(object, ""/*name*/, 1) != 0) {
-            free(object);
+    if (low_memory) {
+        void *compacted = compact_object(object, content_size(object, size));
+        if (compacted == NULL) {
+            member_count--;
+            return 1;
         }
-
-        object = NULL;
+        free(object);
+        object = compacted;
     }
 
-    goto out;
+    member->filename = filename;
+    member->raw = object;
+    member->size = size;
+    member->owns_filename = owns_filename;
 
-out_perror:
-    err = 1;
-    old_errno = errno;
-    fprintf(stderr, "%s", program_name);
-    errno = old_errno;
-    perror(": error");
+    return 0;
+}
 
-out:
-    if (object != NULL && err != 0) {
-        free(object);
+static u32 symdef_hash(char *name) {
+    u32 hash = 5381;
+
+    while (*name != 0) {
+        hash = hash * 33 + (u8)*name++;
     }
-    return err;
+
+    return hash % SYMDEF_BUCKETS;
 }
 
-static int initialise_object(char *filename) {
-    int err = 0, old_errno;
-    FILE *object_file = NULL;
-    long object_size;
-    void *object = NULL;
-    char ar_magic[8];
+static struct symdef *symdef_find(struct symdef **buckets, char *name, u32 hash) {
+    struct symdef *def;
 
-    object_file = fopen(filename, "rb");
-    if (object_file == NULL) {
-        goto out_perror;
+    for (def = buckets[hash]; def != NULL; def = def->next) {
+        if (def->hash == hash && strcmp(def->name, name) == 0) {
+            return def;
+        }
     }
 
-    if (fread(ar_magic, 8, 1, object_file) != 1) {
-        goto out_perror;
-    }
+    return NULL;
+}
 
-    if (memcmp(ar_magic, "!<arch>\n", 8) == 0) {
-        if (v) {
-            fprintf(stderr, "File %s is an archive\n", filename);
-        }
-        err = initialise_archive(object_file);
-        goto out;
+static int symbol_is_def(struct nlist *sym) {
+    if ((sym->n_type & N_EXT) == 0) {
+        return 0;
     }
 
-    if (fseek(object_file, 0, SEEK_END) != 0) {
-        goto out_perror;
+    return (sym->n_type & N_TYPE) == N_TEXT
+        || (sym->n_type & N_TYPE) == N_DATA
+        || (sym->n_type & N_TYPE) == N_BSS
+        || (sym->n_type & N_TYPE) == N_ABS;
+}
+
+static char *copy_string(char *str) {
+    char *copy;
+
+    copy = malloc(strlen(str) + 1);
+    if (copy != NULL) {
+        strcpy(copy, str);
     }
 
-    object_size = ftell(object_file);
-    if (object_size == -1) {
-        goto out_perror;
+    return copy;
+}
+
+static void free_cached_file(struct cached_file *file) {
+    struct cached_object *object, *next;
+
+    for (object = file->objects; object != NULL; object = next) {
+        next = object->next;
+        free(object->filename);
+        free(object->raw);
+        if (object->defs != NULL) {
+            free(object->defs);
+        }
+        free(object);
     }
+    free(file->filename);
+    free(file);
+}
 
-    rewind(object_file);
+/* Record a member of the archive being cached. On success the cache owns */
+/* the object and its heap allocated filename, members that are no a.out */
+/* objects are freed and left out then if quiet, an error otherwise. */
+static int cache_object(void *raw, u32 size, char *filename, int quiet) {
+    int old_errno, i;
+    struct cached_object *object = NULL;
+    struct exec *header = raw;
+    struct nlist *symtab;
+    char *strtab;
 
-    if (v) {
-        fprintf(stderr, "Object file is %ld bytes long.\n", object_size);
+    if (N_GETMAGIC(*header) != OMAGIC) {
+        if (!quiet) {
+            fprintf(stderr, "%s: error: %s is not a valid a.out object file.\n", program_name, filename);
+            return 1;
+        }
+        free(raw);
+        free(filename);
+        return 0;
     }
 
-    object = malloc(object_size);
+    object = malloc(sizeof(struct cached_object));
     if (object == NULL) {
         goto out_perror;
     }
 
-    if (fread(object, object_size, 1, object_file) != 1) {
+    object->filename = filename;
+    object->raw = raw;
+    object->size = content_size(raw, size);
+    object->hash = content_hash(raw, object->size);
+    object->defs = NULL;
+    object->defs_count = 0;
+    object->next = NULL;
+
+    symtab = (void *)((char *)raw + sizeof(struct exec) + header->a_text + header->a_data
+                      + header->a_trsize + header->a_drsize);
+    strtab = (char *)symtab + header->a_syms;
+
+    if (header->a_syms > 0) {
+        object->defs = malloc(header->a_syms / sizeof(struct nlist) * sizeof(struct symdef) + 1);
+        if (object->defs == NULL) {
+            free(object);
+            goto out_perror;
+        }
+    }
+
+    for (i = 0; i < (int)(header->a_syms / sizeof(struct nlist)); i++) {
+        struct symdef *def;
+
+        if (!symbol_is_def(&symtab[i])) {
+            continue;
+        }
+
+        def = &object->defs[object->defs_count++];
+        def->name = strtab + symtab[i].n_strx;
+        def->hash = symdef_hash(def->name);
+        def->member = -1;
+        def->next = NULL;
+    }
+
+    if (recording->last == NULL) {
+        recording->objects = object;
+    } else {
+        recording->last->next = object;
+    }
+    recording->last = object;
+
+    return 0;
+
+out_perror:
+    old_errno = errno;
+    fprintf(stderr, "%s", program_name);
+    errno = old_errno;
+    perror(": error");
+    return 1;
+}
+
+/* Register the members of a cached archive as if it had been read again */
+static int replay_cached_file(struct cached_file *file) {
+    struct cached_object *object;
+    struct member *member;
+
+    for (object = file->objects; object != NULL; object = object->next) {
+        if (!in_group) {
+            if (register_object(object->raw, object->size, object->hash,
+                                object->filename, 0, 1) != 0) {
+                return 1;
+            }
+            continue;
+        }
+
+        member = new_member();
+        if (member == NULL) {
+            return 1;
+        }
+
+        member->filename = object->filename;
+        member->raw = object->raw;
+        member->size = object->size;
+        member->owns_filename = 0;
+        member->cached = object;
+    }
+
+    return 0;
+}
+
+static u32 conv_dec(char *str, int max) {
+    u32 value = 0;
+    while (*str >= '0' && *str <= '9' && max-- > 0) {
+        value *= 10;
+        value += *str++ - '0';
+    }
+    return value;
+}
+
+static int initialise_object(char *filename, int member);
+static int initialise_cached_archive(FILE *ar_file, char *ar_filename, int thin);
+
+/* Thin archive members are named by their path relative to the archive, */
+/* other members get an "archive(member)" name for diagnostics */
+static char *member_path(char *ar_filename, struct ar_header *header,
+                         char *longnames, u32 longnames_size, int thin) {
+    char *name, *path, *slash;
+    u32 name_len, dir_len, offset;
+
+    name = header->name;
+    for (name_len = 0; name_len < 16; name_len++) {
+        if (name[name_len] == '/' && name_len > 0) {
+            break;
+        }
+        if (name[name_len] == ' ') {
+            break;
+        }
+    }
+
+    if (header->name[0] == '/' && header->name[1] >= '0' && header->name[1] <= '9') {
+        /* GNU long name: offset into the // member, terminated by "/\n" */
+        offset = conv_dec(header->name + 1, 15);
+        if (longnames != NULL && offset < longnames_size) {
+            name = longnames + offset;
+            for (name_len = 0; offset + name_len < longnames_size; name_len++) {
+                if (name[name_len] == '\n') {
+                    break;
+                }
+            }
+        } else if (thin) {
+            fprintf(stderr, "%s: error: %s: Bad long name in thin archive\n", program_name, ar_filename);
+            return NULL;
+        }
+    }
+
+    if (name_len > 1 && name[name_len - 1] == '/') {
+        name_len--;
+    }
+
+    if (thin) {
+        /* Relative member paths are relative to the directory of the archive */
+        dir_len = 0;
+        if (name_len == 0 || name[0] != '/') {
+            slash = strrchr(ar_filename, '/');
+            if (slash != NULL) {
+                dir_len = slash - ar_filename + 1;
+            }
+        }
+    } else {
+        dir_len = strlen(ar_filename);
+    }
+
+    path = malloc(dir_len + name_len + 3);
+    if (path == NULL) {
+        int old_errno = errno;
+        fprintf(stderr, "%s", program_name);
+        errno = old_errno;
+        perror(": error");
+        return NULL;
+    }
+
+    memcpy(path, ar_filename, dir_len);
+    if (thin) {
+        memcpy(path + dir_len, name, name_len);
+        path[dir_len + name_len] = 0;
+    } else {
+        path[dir_len] = '(';
+        memcpy(path + dir_len + 1, name, name_len);
+        path[dir_len + name_len + 1] = ')';
+        path[dir_len + name_len + 2] = 0;
+    }
+
+    return path;
+}
+
+/* A thin archive refers to a member of a regular archive it was built from */
+/* as /<name>:<offset>, <offset> being where the member header is in it */
+static int initialise_nested_member(char *ar_filename, u32 offset) {
+    int err = 0, old_errno;
+    FILE *ar_file = NULL;
+    struct ar_header header;
+    void *object = NULL;
+    char *name = NULL, *tmp;
+    u32 size, name_len;
+
+    ar_file = fopen(ar_filename, "rb");
+    if (ar_file == NULL) {
+        goto out_perror;
+    }
+
+    if (fseek(ar_file, offset, SEEK_SET) != 0) {
         goto out_perror;
     }
 
-    err = initialise_gen(object, filename, 0);
+    if (fread(&header, sizeof(struct ar_header), 1, ar_file) != 1) {
+        goto out_perror;
+    }
+
+    if (memcmp(header.endsig, "`\n", 2) != 0) {
+        fprintf(stderr, "%s: error: %s: No archive member at offset %u\n", program_name, ar_filename, offset);
+        err = 1;
+        goto out;
+    }
+
+    size = conv_dec(header.size, 10);
+
+    /* Name it "archive(member)", with the archive path kept after it */
+    /* as the source to read the member back from in low memory mode */
+    name = member_path(ar_filename, &header, NULL, 0, 0);
+    if (name == NULL) {
+        err = 1;
+        goto out;
+    }
+    name_len = strlen(name);
+    tmp = realloc(name, name_len + 1 + strlen(ar_filename) + 1);
+    if (tmp == NULL) {
+        goto out_perror;
+    }
+    name = tmp;
+    strcpy(name + name_len + 1, ar_filename);
+
+    if (v) {
+        fprintf(stderr, "Archiver: Processing nested member %s (size %u)\n", name, size);
+    }
+
+    object = malloc(size);
+    if (object == NULL) {
+        goto out_perror;
+    }
+
+    if (fread(object, size, 1, ar_file) != 1) {
+        goto out_perror;
+    }
+
+    if (recording != NULL) {
+        err = cache_object(object, size, name, 0);
+        goto out;
+    }
+
+    source = name + name_len + 1;
+    source_offset = offset + sizeof(struct ar_header);
+
+    err = initialise_member(object, size, name, 1, 0);
+
+    goto out;
+
+out_perror:
+    err = 1;
+    old_errno = errno;
+    fprintf(stderr, "%s", program_name);
+    errno = old_errno;
+    perror(": error");
+
+out:
+    if (ar_file != NULL) {
+        fclose(ar_file);
+    }
+    if (err != 0) {
+        if (object != NULL) {
+            free(object);
+        }
+        if (name != NULL) {
+            free(name);
+        }
+    }
+    return err;
+}
+
+static int initialise_archive(FILE *ar_file, char *ar_filename, int thin) {
+    int err = 0, old_errno;
+    void *object = NULL;
+    char *longnames = NULL, *name;
+    u32 longnames_size = 0;
+
+    if (fseek(ar_file, 8, SEEK_SET) != 0) {
+        goto out_perror;
+    }
+
+    for (;;) {
+        struct ar_header header;
+        u32 size, size_aligned;
+
+        if (fread(&header, sizeof(struct ar_header), 1, ar_file) != 1) {
+            if (feof(ar_file)) {
+                break;
+            }
+            goto out_perror;
+        }
+
+        size = conv_dec(header.size, 10);
+        size_aligned = size % 2 ? size + 1 : size;
+
+        if (memcmp(header.name, "__.SYMDEF", 9) == 0) {
+            /* size should probably be size_aligned but binutils 2.14a seems */
+            /* to maybe be bugged and not pad __.SYMDEF? */
+            fseek(ar_file, size, SEEK_CUR);
+            continue;
+        }
+
+        if (memcmp(header.name, "// ", 3) == 0) {
+            if (longnames != NULL) {
+                free(longnames);
+            }
+            longnames = malloc(size_aligned);
+            if (longnames == NULL) {
+                goto out_perror;
+            }
+            if (fread(longnames, size_aligned, 1, ar_file) != 1) {
+                goto out_perror;
+            }
+            longnames_size = size;
+            continue;
+        }
+
+        /* Thin archive members carry no data, they name the original object */
+        if (thin && (header.name[0] != '/'
+                  || (header.name[1] >= '0' && header.name[1] <= '9'))) {
+            char *path, *colon;
+
+            path = member_path(ar_filename, &header, longnames, longnames_size, 1);
+            if (path == NULL) {
+                err = 1;
+                goto out;
+            }
+
+            colon = header.name[0] == '/' ? memchr(header.name, ':', 16) : NULL;
+            if (colon != NULL) {
+                err = initialise_nested_member(path, conv_dec(colon + 1, 15 - (colon - header.name)));
+                free(path);
+                if (err != 0) {
+                    goto out;
+                }
+                continue;
+            }
+
+            if (v) {
+                fprintf(stderr, "Archiver: Processing thin member %s (size %u)\n", path, size);
+            }
+
+            if (initialise_object(path, 1) != 0) {
+                free(path);
+                err = 1;
+                goto out;
+            }
+            continue;
+        }
+
+        if (v) {
+            fprintf(stderr, "Archiver: Processing file %.16s (size %u)\n", header.name, size);
+        }
+
+        source = ar_filename;
+        source_offset = ftell(ar_file);
+        if (source_offset == -1) {
+            goto out_perror;
+        }
+
+        object = malloc(size_aligned);
+        if (object == NULL) {
+            goto out_perror;
+        }
+
+        if (fread(object, size_aligned, 1, ar_file) != 1) {
+            goto out_perror;
+        }
+
+        name = member_path(ar_filename, &header, longnames, longnames_size, 0);
+        if (name == NULL) {
+            err = 1;
+            goto out;
+        }
+
+        if (recording != NULL) {
+            if (cache_object(object, size_aligned, name, 1) != 0) {
+                free(name);
+                err = 1;
+                goto out;
+            }
+        } else if (initialise_member(object, size_aligned, name, 1, 1) != 0) {
+            free(object);
+            free(name);
+        }
+
+        object = NULL;
+    }
+
+    goto out;
+
+out_perror:
+    err = 1;
+    old_errno = errno;
+    fprintf(stderr, "%s", program_name);
+    errno = old_errno;
+    perror(": error");
+
+out:
+    if (object != NULL && err != 0) {
+        free(object);
+    }
+    if (longnames != NULL) {
+        free(longnames);
+    }
+    return err;
+}
+
+/* Thin archive members pass member = 1 and hand over their heap allocated filename */
+static int initialise_object(char *filename, int member) {
+    int err = 0, old_errno;
+    FILE *object_file = NULL;
+    long object_size;
+    void *object = NULL;
+    char ar_magic[8];
+    struct cached_file *file;
+
+    /* Low memory links read objects back from their files, not from the cache */
+    if (batch && !low_memory && !member) {
+        for (file = cache; file != NULL; file = file->next) {
+            if (strcmp(file->filename, filename) == 0) {
+                if (v) {
+                    fprintf(stderr, "File %s is cached\n", filename);
+                }
+                return replay_cached_file(file);
+            }
+        }
+    }
+
+    object_file = fopen(filename, "rb");
+    if (object_file == NULL) {
+        goto out_perror;
+    }
+
+    if (fread(ar_magic, 8, 1, object_file) != 1) {
+        goto out_perror;
+    }
+
+    if (member) {
+        /* GNU ar only nests archives as /<name>:<offset> members */
+        if (memcmp(ar_magic, "!<arch>\n", 8) == 0 || memcmp(ar_magic, "!<thin>\n", 8) == 0) {
+            fprintf(stderr, "%s: error: Thin archive member %s is itself an archive\n", program_name, filename);
+            err = 1;
+            goto out;
+        }
+    } else if (memcmp(ar_magic, "!<arch>\n", 8) == 0) {
+        if (v) {
+            fprintf(stderr, "File %s is an archive\n", filename);
+        }
+        err = initialise_cached_archive(object_file, filename, 0);
+        goto out;
+    } else if (memcmp(ar_magic, "!<thin>\n", 8) == 0) {
+        if (v) {
+            fprintf(stderr, "File %s is a thin archive\n", filename);
+        }
+        err = initialise_cached_archive(object_file, filename, 1);
+        goto out;
+    }
+
+    if (fseek(object_file, 0, SEEK_END) != 0) {
+        goto out_perror;
+    }
+
+    object_size = ftell(object_file);
+    if (object_size == -1) {
+        goto out_perror;
+    }
+
+    rewind(object_file);
+
+    if (v) {
+        fprintf(stderr, "Object file is %ld bytes long.\n", object_size);
+    }
+
+    object = malloc(object_size);
+    if (object == NULL) {
+        goto out_perror;
+    }
+
+    if (fread(object, object_size, 1, object_file) != 1) {
+        goto out_perror;
+    }
+
+    if (recording != NULL) {
+        /* Only thin archive members are read while an archive is cached */
+        err = cache_object(object, object_size, filename, 0);
+        goto out;
+    }
+
+    source = filename;
+    source_offset = 0;
+
+    if (member) {
+        err = initialise_member(object, object_size, filename, 1, 0);
+    } else {
+        err = initialise_gen(object, object_size, filename, 0, 0);
+    }
 
     goto out;
 
@@ -410,6 +1232,287 @@ out:
     return err;
 }
 
+/* Batch mode reads an archive into the cache once and replays it from */
+/* there on every link, the first included */
+static int initialise_cached_archive(FILE *ar_file, char *ar_filename, int thin) {
+    int err, old_errno;
+    struct cached_file *file;
+
+    if (!batch || low_memory) {
+        return initialise_archive(ar_file, ar_filename, thin);
+    }
+
+    file = malloc(sizeof(struct cached_file));
+    if (file == NULL) {
+        goto out_perror;
+    }
+
+    file->filename = copy_string(ar_filename);
+    if (file->filename == NULL) {
+        free(file);
+        goto out_perror;
+    }
+    file->objects = file->last = NULL;
+
+    recording = file;
+    err = initialise_archive(ar_file, ar_filename, thin);
+    recording = NULL;
+
+    if (err != 0) {
+        free_cached_file(file);
+        return 1;
+    }
+
+    file->next = cache;
+    cache = file;
+
+    return replay_cached_file(file);
+
+out_perror:
+    old_errno = errno;
+    fprintf(stderr, "%s", program_name);
+    errno = old_errno;
+    perror(": error");
+    return 1;
+}
+
+static int member_symbols(void *raw, struct nlist **symtab, char **strtab) {
+    struct exec *header = raw;
+    u32 symtab_off;
+
+    symtab_off = sizeof(struct exec);
+    if (!low_memory) {
+        symtab_off += header->a_text + header->a_data
+                    + header->a_trsize + header->a_drsize;
+    }
+
+    *symtab = (void *)((char *)raw + symtab_off);
+    *strtab = (char *)raw + symtab_off + header->a_syms;
+
+    return header->a_syms / sizeof(struct nlist);
+}
+
+/* Pull in the members of the current group that are needed to resolve */
+/* the undefined symbols of the objects linked so far. Every symbol of */
+/* the group is indexed once and every object is scanned once, members */
+/* pulled in are appended to objects[] and scanned in turn, so circular */
+/* dependencies between the archives of a group need no rescanning. */
+static int resolve_group(void) {
+    int err = 0, old_errno, i, j, k, scan;
+    int defs_count = 0, defs_used = 0, loaded = 0;
+    struct symdef **buckets = NULL, *defs = NULL, *def;
+    struct nlist *symtab;
+    void *raw;
+    char *strtab;
+    int symtab_count;
+
+    for (i = 0; i < object_count; i++) {
+        defs_count += objects[i].symtab_count;
+    }
+    for (i = 0; i < member_count; i++) {
+        if (members[i].cached != NULL) {
+            defs_count += members[i].cached->defs_count;
+        } else {
+            defs_count += member_symbols(members[i].raw, &symtab, &strtab);
+        }
+    }
+
+    buckets = malloc(SYMDEF_BUCKETS * sizeof(struct symdef *));
+    if (buckets == NULL) {
+        goto out_perror;
+    }
+    for (i = 0; i < SYMDEF_BUCKETS; i++) {
+        buckets[i] = NULL;
+    }
+
+    if (defs_count > 0) {
+        defs = malloc(defs_count * sizeof(struct symdef));
+        if (defs == NULL) {
+            goto out_perror;
+        }
+    }
+
+    /* Definitions already linked come first, like in get_symbol() */
+    for (i = -object_count; i < member_count; i++) {
+        if (i >= 0 && members[i].cached != NULL) {
+            /* Batch mode found these when it cached the archive */
+            struct cached_object *cached = members[i].cached;
+
+            for (j = 0; j < cached->defs_count; j++) {
+                char *symname = cached->defs[j].name;
+                u32 hash = cached->defs[j].hash;
+
+                if (symdef_find(buckets, symname, hash) != NULL) {
+                    continue;
+                }
+
+                def = &defs[defs_used++];
+                def->name = symname;
+                def->hash = hash;
+                def->member = i;
+                def->next = buckets[hash];
+                buckets[hash] = def;
+            }
+            continue;
+        }
+
+        if (i < 0) {
+            symtab = objects[object_count + i].symtab;
+            strtab = objects[object_count + i].strtab;
+            symtab_count = objects[object_count + i].symtab_count;
+        } else {
+            symtab_count = member_symbols(members[i].raw, &symtab, &strtab);
+        }
+
+        for (j = 0; j < symtab_count; j++) {
+            char *symname = strtab + symtab[j].n_strx;
+            u32 hash;
+
+            if (!symbol_is_def(&symtab[j])) {
+                continue;
+            }
+
+            hash = symdef_hash(symname);
+            if (symdef_find(buckets, symname, hash) != NULL) {
+                continue;
+            }
+
+            def = &defs[defs_used++];
+            def->name = symname;
+            def->hash = hash;
+            def->member = i < 0 ? -1 : i;
+            def->next = buckets[hash];
+            buckets[hash] = def;
+        }
+    }
+
+    for (scan = 0; scan < object_count; scan++) {
+        for (j = 0; j < objects[scan].symtab_count; j++) {
+            /* Pulling in a member may move objects[] */
+            struct object *object = &objects[scan];
+            struct nlist *sym = &object->symtab[j];
+            struct member *member;
+            char *symname;
+
+            if ((sym->n_type & N_TYPE) != N_UNDF || sym->n_value != 0) {
+                continue;
+            }
+
+            symname = object->strtab + sym->n_strx;
+            def = symdef_find(buckets, symname, symdef_hash(symname));
+            if (def == NULL || def->member == -1) {
+                continue;
+            }
+
+            member = &members[def->member];
+            def->member = -1;
+            if (member->loaded) {
+                continue;
+            }
+
+            if (v) {
+                fprintf(stderr, "Group: Pulling in %s for %s\n", member->filename, def->name);
+            }
+
+            /* Everything the member defines is linked from now on, whichever */
+            /* member the index first found it in */
+            if (member->cached != NULL) {
+                for (k = 0; k < member->cached->defs_count; k++) {
+                    struct symdef *member_def = &member->cached->defs[k];
+
+                    member_def = symdef_find(buckets, member_def->name, member_def->hash);
+                    if (member_def != NULL) {
+                        member_def->member = -1;
+                    }
+                }
+            } else {
+                symtab_count = member_symbols(member->raw, &symtab, &strtab);
+                for (k = 0; k < symtab_count; k++) {
+                    struct symdef *member_def;
+
+                    if (!symbol_is_def(&symtab[k])) {
+                        continue;
+                    }
+
+                    symname = strtab + symtab[k].n_strx;
+                    member_def = symdef_find(buckets, symname, symdef_hash(symname));
+                    if (member_def != NULL) {
+                        member_def->member = -1;
+                    }
+                }
+            }
+
+            source = member->source;
+            source_offset = member->source_offset;
+
+            if (low_memory) {
+                /* The compacted member stays, the index points into it */
+                raw = malloc(member->size);
+                if (raw == NULL) {
+                    goto out_perror;
+                }
+                if (read_source(source, source_offset, raw, member->size) != 0) {
+                    free(raw);
+                    err = 1;
+                    goto out;
+                }
+            } else {
+                raw = member->raw;
+            }
+
+            if (member->cached != NULL) {
+                err = register_object(raw, member->cached->size, member->cached->hash,
+                                      member->filename, 0, 1);
+            } else {
+                err = initialise_gen(raw, member->size, member->filename, member->owns_filename, 0);
+            }
+            if (err != 0) {
+                if (low_memory) {
+                    free(raw);
+                }
+                err = 1;
+                goto out;
+            }
+            if (!low_memory) {
+                member->raw = NULL;
+            }
+            member->loaded = 1;
+            loaded++;
+        }
+    }
+
+    if (v) {
+        fprintf(stderr, "Group: Linked %d of %d members\n", loaded, member_count);
+    }
+
+    goto out;
+
+out_perror:
+    err = 1;
+    old_errno = errno;
+    fprintf(stderr, "%s", program_name);
+    errno = old_errno;
+    perror(": error");
+
+out:
+    for (i = 0; i < member_count; i++) {
+        if (members[i].raw != NULL && members[i].cached == NULL) {
+            free(members[i].raw);
+        }
+        if (members[i].owns_filename && !members[i].loaded) {
+            free(members[i].filename);
+        }
+    }
+    member_count = 0;
+    if (buckets != NULL) {
+        free(buckets);
+    }
+    if (defs != NULL) {
+        free(defs);
+    }
+    return err;
+}
+
 static int get_symbol(struct object **obj_out, int *index, char *name, int quiet) {
     int object_i, symbol_i;
 
@@ -507,6 +1610,37 @@ out:
     return err;
 }
 
+static int reloc_length(u32 r_type) {
+    int length = (r_type & (3 << 25)) >> 25;
+
+    switch (length) {
+        case 0: length = 1; break;
+        case 1: length = 2; break;
+        case 2: length = 4; break;
+    }
+
+    return length;
+}
+
+/* The bytes a relocation patches, in the output image or, while the */
+/* object is being streamed out, in its own sections */
+static char *reloc_target(struct object *object, struct relocation_info *r, int is_data) {
+    if (object->sections == NULL) {
+        return (char *)output + text_off + r->r_address;
+    }
+
+    if (is_data) {
+        return object->sections + object->header->a_text
+             + (r->r_address - text_size - object->data_slide);
+    }
+
+    return object->sections + (r->r_address - object->text_slide);
+}
+
+static i32 pcrel_value(struct relocation_info *r, struct nlist *symbol) {
+    return (i32)symbol->n_value - (r->r_address + reloc_length(r->r_type));
+}
+
 static int relocate(struct object *object, struct relocation_info *r, int is_data) {
     struct nlist *symbol;
     i32 result;
@@ -519,12 +1653,7 @@ static int relocate(struct object *object, struct relocation_info *r, int is_dat
     int rel = (r->r_type & (1 << 30)) >> 30;
     int copy = (r->r_type & (1 << 31)) >> 31;
 
-    int length = (r->r_type & (3 << 25)) >> 25;
-    switch (length) {
-        case 0: length = 1; break;
-        case 1: length = 2; break;
-        case 2: length = 4; break;
-    }
+    int length = reloc_length(r->r_type);
 
     if ((is_data && pcrel) || baserel || jmptable || rel || copy) {
         fprintf(stderr, "%s: Unsupported relocation type\n", program_name);
@@ -543,12 +1672,14 @@ static int relocate(struct object *object, struct relocation_info *r, int is_dat
         }
 
         symbol = &symobj->symtab[symindex];
+        external_relocs++;
     } else {
         symbol = &object->symtab[symbolnum];
+        local_relocs++;
     }
 
     if (pcrel) {
-        result = (i32)symbol->n_value - (r->r_address + length);
+        result = pcrel_value(r, symbol);
     } else {
         if ((symbol->n_type & N_TYPE) == N_BSS
          || (symbol->n_type & N_TYPE) == N_DATA
@@ -565,15 +1696,39 @@ static int relocate(struct object *object, struct relocation_info *r, int is_dat
         result = symbol->n_value;
     }
 
-    memcpy((char *)output + sizeof(struct exec) + r->r_address, &result, length);
+    memcpy(reloc_target(object, r, is_data), &result, length);
 
     return 0;
 }
 
+/* Pc relative relocations within an object produce no output relocation */
+/* and only depend on the slid symbol table, so they are patched in a pass */
+/* of their own before glue() sees the rest */
+static void local_pcrel(struct object *object) {
+    int i;
+
+    for (i = 0; i < object->trelocs_count; i++) {
+        struct relocation_info *r = &object->trelocs[i];
+        i32 result;
+
+        if ((r->r_type & R_LOCAL_PCREL_MASK) != R_LOCAL_PCREL) {
+            continue;
+        }
+
+        result = pcrel_value(r, &object->symtab[r->r_type & 0xffffff]);
+        memcpy(reloc_target(object, r, 0), &result, reloc_length(r->r_type));
+        local_pcrel_relocs++;
+    }
+}
+
 static int glue(struct object *object) {
     int i;
 
     for (i = 0; i < object->trelocs_count; i++) {
+        /* Already patched by local_pcrel() */
+        if ((object->trelocs[i].r_type & R_LOCAL_PCREL_MASK) == R_LOCAL_PCREL) {
+            continue;
+        }
         if (relocate(object, &object->trelocs[i], 0) != 0) {
             return 1;
         }
@@ -588,19 +1743,105 @@ static int glue(struct object *object) {
     return 0;
 }
 
+static int write_region(u32 offset, void *buf, u32 size, u32 aligned_size) {
+    if (fseek(output_stream, offset, SEEK_SET) != 0) {
+        return 1;
+    }
+
+    if (size > 0 && fwrite(buf, size, 1, output_stream) != 1) {
+        return 1;
+    }
+
+    if (aligned_size > size && fwrite(zero_page, aligned_size - size, 1, output_stream) != 1) {
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Low memory mode: read the object's sections and relocations in one go, */
+/* glue them in place, write the object's text and data regions out and */
+/* free it all again */
+static int stream(struct object *object) {
+    int err = 0, old_errno;
+    struct exec *header = object->header;
+    u32 sections_size, text_region, data_region;
+
+    sections_size = header->a_text + header->a_data + header->a_trsize + header->a_drsize;
+
+    object->sections = malloc(sections_size + 1);
+    if (object->sections == NULL) {
+        goto out_perror;
+    }
+
+    if (read_source(object->source, object->source_offset + sizeof(struct exec),
+                    object->sections, sections_size) != 0) {
+        err = 1;
+        goto out;
+    }
+
+    object->trelocs = (void *)(object->sections + header->a_text + header->a_data);
+    object->drelocs = (void *)((char *)object->trelocs + header->a_trsize);
+    slide_relocations(object);
+    local_pcrel(object);
+
+    if (glue(object) != 0) {
+        err = 1;
+        goto out;
+    }
+
+    if (impure) {
+        text_region = header->a_text;
+        data_region = header->a_data;
+    } else {
+        text_region = ALIGN_UP(header->a_text, PAGE_SIZE);
+        data_region = ALIGN_UP(header->a_data, PAGE_SIZE);
+    }
+
+    if (write_region(text_off + object->text_slide, object->sections,
+                     header->a_text, text_region) != 0
+     || write_region(data_off + object->data_slide, object->sections + header->a_text,
+                     header->a_data, data_region) != 0) {
+        goto out_perror;
+    }
+
+    goto out;
+
+out_perror:
+    err = 1;
+    old_errno = errno;
+    fprintf(stderr, "%s", program_name);
+    errno = old_errno;
+    perror(": error");
+
+out:
+    if (object->sections != NULL) {
+        free(object->sections);
+        object->sections = NULL;
+        object->trelocs = NULL;
+        object->drelocs = NULL;
+    }
+    return err;
+}
+
 void help(void) {
     printf("Usage: %s [options...] [object/archives...]\n", program_name);
     printf("Options:\n");
     printf("  -o <filename>      Output file name (default: a.out)\n");
+    printf("  --batch <manifest> Link one executable per line of arguments in <manifest>\n");
+    printf("                     (--verbose and --help are not accepted in <manifest>)\n");
     printf("  -N                 Generate impure executable\n");
+    printf("  --low-memory       Keep only symbol tables in memory, stream the rest\n");
     printf("  -s                 Strip all (*)\n");
     printf("  -nostdlib          Do not link against standard library (*)\n");
+    printf("  --start-group      Start a group of archives whose members are linked on demand\n");
+    printf("  --end-group        End a group of archives\n");
     printf("  --verbose          Enable verbose mode\n");
     printf("  -h, --help         Shows this help message\n");
     printf(" (*) currently unimplemented\n");
 }
 
-int main(int argc, char *argv[]) {
+static int link_executable(int argc, char *argv[]) {
     int err = 0, old_errno, i;
     struct exec *header;
     struct object *entry_obj;
@@ -608,33 +1849,19 @@ int main(int argc, char *argv[]) {
     FILE *output_file = NULL;
     char *output_filename = "a.out";
     u32 output_size;
-
-    program_name = argv[0];
-
-    /* Check fixed width type sizes */
-    if (sizeof(u8) != 1 || sizeof(u16) != 2 || sizeof(u32) != 4) {
-        fprintf(stderr, "%s: error: Fixed width types of wrong size", program_name);
-        err = 1;
-        goto out;
-    }
-
-    for (i = 1; i < argc; i++) {
-        if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
-            help();
-            goto out;
-        }
-    }
-
-    /* Find the verbose flag before everything else */
-    for (i = 1; i < argc; i++) {
-        if (strcmp(argv[i], "--verbose") == 0) {
-            fprintf(stderr, "PDLD: Public Domain a.out Linker\n\n");
-            fprintf(stderr, "Being verbose.\n");
-            v = 1;
-            strip_arg(&argc, argv, i);
-            break;
-        }
-    }
+    struct exec stream_header;
+
+    /* Start from a clean slate, batch mode links many times per process */
+    nostdlib = strip_all = impure = low_memory = 0;
+    local_pcrel_relocs = local_relocs = external_relocs = 0;
+    output = NULL;
+    output_stream = NULL;
+    text_size = data_size = bss_size = 0;
+    text_ptr = data_ptr = bss_ptr = 0;
+    object_count = member_count = in_group = 0;
+    tgr.relocations_count = dgr.relocations_count = 0;
+    tgr.relocations_max = dgr.relocations_max = 64;
+    tgr.relocations = dgr.relocations = NULL;
 
     for (i = 1; i < argc; ) {
         if (strcmp(argv[i], "-nostdlib") == 0) {
@@ -647,6 +1874,11 @@ int main(int argc, char *argv[]) {
             if (v) {
                 fprintf(stderr, "Strip all.\n");
             }
+        } else if (strcmp(argv[i], "--low-memory") == 0) {
+            low_memory = 1;
+            if (v) {
+                fprintf(stderr, "Low memory.\n");
+            }
         } else if (strcmp(argv[i], "-N") == 0) {
             impure = 1;
             if (v) {
@@ -664,7 +1896,10 @@ int main(int argc, char *argv[]) {
             }
             strip_arg(&argc, argv, i + 1);
         } else {
-            if (*argv[i] != '-') {
+            /* Group delimiters are positional, leave them among the inputs */
+            if (*argv[i] != '-'
+             || strcmp(argv[i], "--start-group") == 0
+             || strcmp(argv[i], "--end-group") == 0) {
                 i++;
                 continue;
             }
@@ -681,16 +1916,46 @@ int main(int argc, char *argv[]) {
     }
 
     for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--start-group") == 0) {
+            if (in_group) {
+                fprintf(stderr, "%s: error: Nested --start-group\n", program_name);
+                err = 1;
+                goto out;
+            }
+            in_group = 1;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--end-group") == 0) {
+            if (!in_group) {
+                fprintf(stderr, "%s: error: --end-group without --start-group\n", program_name);
+                err = 1;
+                goto out;
+            }
+            in_group = 0;
+            if (resolve_group() != 0) {
+                err = 1;
+                goto out;
+            }
+            continue;
+        }
+
         if (v) {
             fprintf(stderr, "Initialising object: %s\n", argv[i]);
         }
 
-        if (initialise_object(argv[i]) != 0) {
+        if (initialise_object(argv[i], 0) != 0) {
             err = 1;
             goto out;
         }
     }
 
+    if (in_group) {
+        fprintf(stderr, "%s: error: --start-group without --end-group\n", program_name);
+        err = 1;
+        goto out;
+    }
+
     if (v) {
         fprintf(stderr, "Calculated text size: %u\n", text_size);
         fprintf(stderr, "Calculated data size: %u\n", data_size);
@@ -703,22 +1968,34 @@ int main(int argc, char *argv[]) {
         output_size = ALIGN_UP(sizeof(struct exec), PAGE_SIZE) + text_size + data_size;
     }
 
-    output = malloc(output_size);
-    if (output == NULL) {
-        goto out_perror;
-    }
+    if (low_memory) {
+        /* Objects are written straight into the output file, see stream() */
+        output_file = fopen(output_filename, "wb");
+        if (output_file == NULL) {
+            goto out_perror;
+        }
+        output_stream = output_file;
+
+        memset(&stream_header, 0, sizeof(struct exec));
+        header = &stream_header;
+    } else {
+        output = malloc(output_size);
+        if (output == NULL) {
+            goto out_perror;
+        }
 
-    memset(output, 0, output_size);
+        memset(output, 0, output_size);
 
-    header = output;
+        header = output;
+    }
 
     if (impure) {
-        text = (void *)((char *)output + sizeof(struct exec));
+        text_off = sizeof(struct exec);
     } else {
-        text = (void *)((char *)output + ALIGN_UP(sizeof(struct exec), PAGE_SIZE));
+        text_off = ALIGN_UP(sizeof(struct exec), PAGE_SIZE);
     }
 
-    data = (void *)((char *)text + text_size);
+    data_off = text_off + text_size;
 
     for (i = 0; i < object_count; i++) {
         paste(&objects[i]);
@@ -728,6 +2005,14 @@ int main(int argc, char *argv[]) {
         apply_slides(&objects[i]);
     }
 
+    /* In low memory mode the relocations are not loaded yet, stream() */
+    /* runs this pass as it reads each object in */
+    if (!low_memory) {
+        for (i = 0; i < object_count; i++) {
+            local_pcrel(&objects[i]);
+        }
+    }
+
     for (i = 0; i < object_count; i++) {
         undf_collect(&objects[i]);
     }
@@ -737,12 +2022,17 @@ int main(int argc, char *argv[]) {
     }
 
     for (i = 0; i < object_count; i++) {
-        if (glue(&objects[i]) != 0) {
+        if ((low_memory ? stream(&objects[i]) : glue(&objects[i])) != 0) {
             err = 1;
             goto out;
         }
     }
 
+    if (v) {
+        fprintf(stderr, "Relocations: %u local pc relative (first pass), %u other local, %u external\n",
+                local_pcrel_relocs, local_relocs, external_relocs);
+    }
+
     if (get_symbol(&entry_obj, &entry_index, "___start", 0) == 1) {
         fprintf(stderr, "%s: error: Cannot find entry point\n", program_name);
         err = 1;
@@ -757,13 +2047,20 @@ int main(int argc, char *argv[]) {
     header->a_trsize = tgr.relocations_count * sizeof(struct relocation_info);
     header->a_drsize = dgr.relocations_count * sizeof(struct relocation_info);
 
-    output_file = fopen(output_filename, "wb");
-    if (output_file == NULL) {
-        goto out_perror;
-    }
+    if (low_memory) {
+        if (write_region(0, header, sizeof(struct exec), text_off) != 0
+         || fseek(output_file, output_size, SEEK_SET) != 0) {
+            goto out_perror;
+        }
+    } else {
+        output_file = fopen(output_filename, "wb");
+        if (output_file == NULL) {
+            goto out_perror;
+        }
 
-    if (fwrite(output, output_size, 1, output_file) != 1) {
-        goto out_perror;
+        if (fwrite(output, output_size, 1, output_file) != 1) {
+            goto out_perror;
+        }
     }
 
     if (fwrite(tgr.relocations,
@@ -790,7 +2087,28 @@ out_perror:
 out:
     for (i = 0; i < object_count; i++) {
         free(objects[i].raw);
+        if (objects[i].owns_filename) {
+            free(objects[i].filename);
+        }
+    }
+    if (objects != NULL) {
+        free(objects);
+        objects = NULL;
+    }
+    objects_max = 0;
+    for (i = 0; i < member_count; i++) {
+        if (members[i].cached == NULL) {
+            free(members[i].raw);
+        }
+        if (members[i].owns_filename) {
+            free(members[i].filename);
+        }
+    }
+    if (members != NULL) {
+        free(members);
+        members = NULL;
     }
+    members_max = 0;
     if (tgr.relocations != NULL) {
         free(tgr.relocations);
     }
@@ -800,8 +2118,195 @@ out:
     if (output != NULL) {
         free(output);
     }
+    close_source();
     if (output_file != NULL) {
         fclose(output_file);
+        if (low_memory && err != 0) {
+            remove(output_filename);
+        }
+    }
+    return err;
+}
+
+/* The links of a manifest run one after the other in this process, what */
+/* they share is the archives in the cache */
+static int link_batch(char *manifest_filename) {
+    int err = 0, old_errno, argc, i, line_number = 0;
+    FILE *manifest_file = NULL;
+    long manifest_size;
+    char *manifest = NULL, *line, *end, *stop, *p;
+    char **argv = NULL;
+    struct cached_file *next;
+
+    manifest_file = fopen(manifest_filename, "rb");
+    if (manifest_file == NULL) {
+        goto out_perror;
+    }
+
+    if (fseek(manifest_file, 0, SEEK_END) != 0) {
+        goto out_perror;
+    }
+
+    manifest_size = ftell(manifest_file);
+    if (manifest_size == -1) {
+        goto out_perror;
+    }
+
+    rewind(manifest_file);
+
+    manifest = malloc(manifest_size + 1);
+    if (manifest == NULL) {
+        goto out_perror;
+    }
+
+    if (manifest_size > 0 && fread(manifest, manifest_size, 1, manifest_file) != 1) {
+        goto out_perror;
+    }
+    manifest[manifest_size] = 0;
+
+    batch = 1;
+
+    /* Every line holds the arguments of one standalone invocation */
+    for (line = manifest; *line != 0; line = end) {
+        line_number++;
+
+        end = strchr(line, '\n');
+        if (end == NULL) {
+            end = line + strlen(line);
+        } else {
+            *end++ = 0;
+        }
+
+        argc = 1;
+        for (p = line; *p != 0 && *p != '#'; ) {
+            if (*p == ' ' || *p == '\t' || *p == '\r') {
+                *p++ = 0;
+                continue;
+            }
+            argc++;
+            while (*p != 0 && *p != ' ' && *p != '\t' && *p != '\r') {
+                p++;
+            }
+        }
+        *p = 0;
+        stop = p;
+
+        if (argc == 1) {
+            continue;
+        }
+
+        argv = malloc((argc + 1) * sizeof(char *));
+        if (argv == NULL) {
+            goto out_perror;
+        }
+
+        argv[0] = program_name;
+        for (argc = 1, p = line; p < stop; p++) {
+            if (*p != 0 && (p == line || p[-1] == 0)) {
+                argv[argc++] = p;
+            }
+        }
+        argv[argc] = NULL;
+
+        /* These act on the whole process, main() only takes them on the command line */
+        for (i = 1; i < argc; i++) {
+            if (strcmp(argv[i], "--verbose") == 0
+             || strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0
+             || strcmp(argv[i], "--batch") == 0) {
+                break;
+            }
+        }
+
+        if (i < argc) {
+            fprintf(stderr, "%s: error: %s:%d: %s is not accepted in a batch manifest\n",
+                    program_name, manifest_filename, line_number, argv[i]);
+            err = 1;
+        } else {
+            if (v) {
+                fprintf(stderr, "Batch: Linking line %d of %s\n", line_number, manifest_filename);
+            }
+
+            if (link_executable(argc, argv) != 0) {
+                fprintf(stderr, "%s: error: %s:%d: Link failed\n", program_name, manifest_filename, line_number);
+                err = 1;
+            }
+        }
+
+        free(argv);
+        argv = NULL;
+    }
+
+    goto out;
+
+out_perror:
+    err = 1;
+    old_errno = errno;
+    fprintf(stderr, "%s", program_name);
+    errno = old_errno;
+    perror(": error");
+
+out:
+    for (; cache != NULL; cache = next) {
+        next = cache->next;
+        free_cached_file(cache);
+    }
+    batch = 0;
+    if (argv != NULL) {
+        free(argv);
+    }
+    if (manifest != NULL) {
+        free(manifest);
+    }
+    if (manifest_file != NULL) {
+        fclose(manifest_file);
+    }
+    return err;
+}
+
+int main(int argc, char *argv[]) {
+    int err = 0, i;
+
+    program_name = argv[0];
+
+    /* Check fixed width type sizes */
+    if (sizeof(u8) != 1 || sizeof(u16) != 2 || sizeof(u32) != 4) {
+        fprintf(stderr, "%s: error: Fixed width types of wrong size", program_name);
+        err = 1;
+        goto out;
+    }
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
+            help();
+            goto out;
+        }
+    }
+
+    /* Find the verbose flag before everything else */
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--verbose") == 0) {
+            fprintf(stderr, "PDLD: Public Domain a.out Linker\n\n");
+            fprintf(stderr, "Being verbose.\n");
+            v = 1;
+            strip_arg(&argc, argv, i);
+            break;
+        }
+    }
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--batch") == 0) {
+            if (argc != 3 || i != 1) {
+                fprintf(stderr, "%s: error: --batch takes a manifest file name and no other arguments.\n", program_name);
+                err = 1;
+                goto out;
+            }
+            err = link_batch(argv[2]);
+            goto out;
+        }
     }
+
+    err = link_executable(argc, argv);
+
+out:
     return err;
 }